@@ -0,0 +1,102 @@
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+// Double-buffered output file. Rows are formatted into the front buffer on
+// the calling thread; flush() hands the buffer to a background thread which
+// writes it while the caller keeps formatting, or computing, on the next one.
+// A caller only blocks when the previous chunk has not been written yet.
+// Without the background thread every flush writes on the calling thread.
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace async_io {
+
+// Chunk size at which flushIfFull() hands the front buffer over.
+const size_t CHUNK_SIZE = 1 << 16;
+
+class AsyncWriter {
+public:
+    AsyncWriter(const std::string &file, std::ios_base::openmode mode = std::ios_base::out,
+            bool background = true)
+            : output(file, mode), hasBack(false), closing(false), closed(false) {
+        if (background) { writer = std::thread(&AsyncWriter::writeLoop, this); }
+    }
+
+    ~AsyncWriter() { close(); }
+
+    std::ostream &stream() { return front; }
+
+    void flushIfFull() {
+        if (front.tellp() >= (std::streamoff)CHUNK_SIZE) { flush(); }
+    }
+
+    void flush() {
+        std::string chunk = front.str();
+        front.str("");
+        if (chunk.empty()) { return; }
+        if (!writer.joinable()) {
+            output << chunk;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock{ mtx };
+        written.wait(lock, [this]() { return !hasBack; });
+        back.swap(chunk);
+        hasBack = true;
+        lock.unlock();
+        pending.notify_one();
+    }
+
+    // Writes whatever is left and waits for the background thread.
+    void close() {
+        if (closed) { return; }
+        closed = true;
+        flush();
+        if (writer.joinable()) {
+            std::unique_lock<std::mutex> lock{ mtx };
+            closing = true;
+            lock.unlock();
+            pending.notify_one();
+            writer.join();
+        }
+        output.close();
+    }
+
+private:
+    std::ofstream output;
+    std::ostringstream front;
+    std::string back;
+    bool hasBack;
+    bool closing;
+    bool closed;
+
+    std::mutex mtx;
+    std::condition_variable pending;
+    std::condition_variable written;
+    std::thread writer;
+
+    void writeLoop() {
+        std::string chunk;
+        while (true) {
+            std::unique_lock<std::mutex> lock{ mtx };
+            pending.wait(lock, [this]() { return hasBack || closing; });
+            if (!hasBack) { break; }
+            chunk.swap(back);
+            hasBack = false;
+            lock.unlock();
+            written.notify_one();
+
+            output << chunk;
+            chunk.clear();
+        }
+    }
+};
+
+} // namespace async_io
+
+#endif
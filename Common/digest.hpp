@@ -0,0 +1,96 @@
+#ifndef DIGEST_HPP
+#define DIGEST_HPP
+
+// Allocation-free SHA-1 for the worker hot path. Produces the same lowercase
+// hex digest as SHA1::final() from sha1-master, written into a caller-owned
+// buffer instead of a std::string.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace digest {
+
+const int SHA1_HEX_LENGTH = 40;
+
+inline uint32_t rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+inline void sha1Block(uint32_t state[5], const unsigned char *block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+            | (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// Writes SHA1_HEX_LENGTH hex characters and a terminating zero to out.
+inline void sha1Hex(const char *data, size_t length, char *out) {
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    size_t full = length - length % 64;
+    for (size_t i = 0; i < full; i += 64) {
+        sha1Block(state, bytes + i);
+    }
+
+    unsigned char tail[128] = {};
+    size_t rest = length - full;
+    memcpy(tail, bytes + full, rest);
+    tail[rest] = 0x80;
+    size_t tailLength = (rest < 56) ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailLength - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    sha1Block(state, tail);
+    if (tailLength == 128) {
+        sha1Block(state, tail + 64);
+    }
+
+    const char *hex = "0123456789abcdef";
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 8; j++) {
+            out[i * 8 + j] = hex[(state[i] >> (28 - j * 4)) & 0xf];
+        }
+    }
+    out[SHA1_HEX_LENGTH] = 0;
+}
+
+} // namespace digest
+
+#endif
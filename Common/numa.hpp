@@ -0,0 +1,175 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+// NUMA topology, thread pinning and page placement queries for the
+// shared-memory programs. Reads the topology from sysfs and uses raw
+// syscalls, so no libnuma is needed. Outside Linux everything reports a
+// single node and pinning does nothing.
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace numa {
+
+struct AccessCounts {
+    long long local = 0;
+    long long remote = 0;
+    long long unknown = 0;
+};
+
+// Parses sysfs lists such as "0-3,8-11" (cpu lists and the online node list).
+inline std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) { end = list.size(); }
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        if (!range.empty() && range[0] != '\n') {
+            int from = std::stoi(range.substr(0, dash));
+            int to = (dash == std::string::npos) ? from : std::stoi(range.substr(dash + 1));
+            for (int cpu = from; cpu <= to; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+struct Node {
+    int id; // kernel node number, as reported by move_pages
+    std::vector<int> cpus;
+};
+
+// Online nodes that have CPUs this process may run on. Node ids can be
+// sparse and memory-only nodes have no CPUs, so positions in this list are
+// not kernel node ids.
+inline const std::vector<Node> &nodes() {
+    static std::vector<Node> online = []() {
+        std::vector<Node> result;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        std::ifstream onlineFile("/sys/devices/system/node/online");
+        std::string onlineList;
+        std::getline(onlineFile, onlineList);
+        for (int id : parseCpuList(onlineList)) {
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            std::getline(f, list);
+            Node node{ id, {} };
+            for (int cpu : parseCpuList(list)) {
+                if (CPU_ISSET(cpu, &allowed)) { node.cpus.push_back(cpu); }
+            }
+            if (!node.cpus.empty()) { result.push_back(node); }
+        }
+#endif
+        if (result.empty()) {
+            Node node{ 0, {} };
+            for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++) {
+                node.cpus.push_back(cpu);
+            }
+            if (node.cpus.empty()) { node.cpus.push_back(0); }
+            result.push_back(node);
+        }
+        return result;
+    }();
+    return online;
+}
+
+inline int nodeCount() {
+    return nodes().size();
+}
+
+// k-th CPU of the node at the given position, wrapping around when there are
+// more workers than CPUs.
+inline int cpuOnNode(int node, int k) {
+    const std::vector<int> &cpus = nodes()[node % nodeCount()].cpus;
+    return cpus[k % cpus.size()];
+}
+
+// Kernel id of the node a CPU belongs to.
+inline int nodeOfCpu(int cpu) {
+    for (const Node &node : nodes()) {
+        for (int c : node.cpus) {
+            if (c == cpu) { return node.id; }
+        }
+    }
+    return nodes()[0].id;
+}
+
+// Spreads workers round-robin over the nodes and pins the calling thread.
+inline bool pinWorker(int worker, int usedNodes) {
+#ifdef __linux__
+    int cpu = cpuOnNode(worker % usedNodes, worker / usedNodes);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Kernel id of the node the calling thread runs on.
+inline int currentNode() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    return cpu < 0 ? nodes()[0].id : nodeOfCpu(cpu);
+#else
+    return 0;
+#endif
+}
+
+// Classifies n records by whether the page each one starts on resides on
+// the node with the given kernel id. Uses a single move_pages query for the
+// whole range.
+template <class T>
+void countAccesses(const T *data, int n, int node, AccessCounts &counts) {
+    if (n < 1) { return; }
+#ifdef __linux__
+    const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = (uintptr_t)data & ~(pageSize - 1);
+    const uintptr_t last = (uintptr_t)(data + n - 1) & ~(pageSize - 1);
+    const size_t pageCount = (last - first) / pageSize + 1;
+
+    std::vector<void *> pages(pageCount);
+    std::vector<int> status(pageCount, -1);
+    for (size_t i = 0; i < pageCount; i++) {
+        pages[i] = (void *)(first + i * pageSize);
+    }
+    if (syscall(SYS_move_pages, 0, pageCount, pages.data(), nullptr, status.data(), 0) != 0) {
+        counts.unknown += n;
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int pageNode = status[((uintptr_t)(data + i) - first) / pageSize];
+        if (pageNode < 0) {
+            counts.unknown++;
+        } else if (pageNode == node) {
+            counts.local++;
+        } else {
+            counts.remote++;
+        }
+    }
+#else
+    counts.unknown += n;
+#endif
+}
+
+} // namespace numa
+
+#endif
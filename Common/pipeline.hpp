@@ -0,0 +1,87 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+// Record pipeline shared by the host programs: hash a car, decide whether it
+// belongs in the results and order the results. Each step is a policy type,
+// so every combination is a separate specialization the compiler can inline;
+// the configuration is resolved once per run by dispatchYearFilter().
+//
+// Records need name, year, mileage and a char hash[SHA1_HEX_LENGTH + 1].
+
+#include <string_view>
+#include <utility>
+#include "digest.hpp"
+#include "pool.hpp"
+
+namespace pipeline {
+
+// Predicate: keeps cars made in FromYear or later, threshold known at compile time.
+template <int FromYear>
+struct YearFrom {
+    static constexpr int fromYear = FromYear;
+
+    template <class Record>
+    bool operator()(const Record &car) const { return fromYear <= car.year; }
+};
+
+// Predicate: same filter with a threshold chosen at run time.
+struct YearFromRuntime {
+    int fromYear;
+
+    template <class Record>
+    bool operator()(const Record &car) const { return fromYear <= car.year; }
+};
+
+// KeyFn: results are ordered by their hex digest.
+struct HashKey {
+    template <class Record>
+    std::string_view operator()(const Record &car) const { return car.hash; }
+};
+
+// Hasher: SHA-1 of name + to_string(year) + to_string(mileage).
+struct Sha1Hasher {
+    template <class Record>
+    void operator()(Record &car) const {
+        pool::ScratchBuffer &input = pool::scratch(1);
+        input.clear();
+        input.append(car.name.data(), car.name.size());
+        input.appendf("%d%f", car.year, car.mileage);
+        digest::sha1Hex(input.data(), input.size(), car.hash);
+    }
+};
+
+template <class Predicate, class KeyFn, class Hasher>
+struct Pipeline {
+    Predicate keep;
+    KeyFn key;
+    Hasher hasher;
+
+    // Hashes the record, returns whether it belongs in the results.
+    template <class Record>
+    bool process(Record &car) const {
+        hasher(car);
+        return keep(car);
+    }
+
+    // Whether a comes before b in the results.
+    template <class Record>
+    bool before(const Record &a, const Record &b) const {
+        return key(a) < key(b);
+    }
+};
+
+// Calls run with the pipeline specialized for fromYear. KnownFromYear is the
+// program's compile-time default; any other value falls back to a runtime
+// threshold.
+template <int KnownFromYear, class F>
+void dispatchYearFilter(int fromYear, F &&run) {
+    if (fromYear == KnownFromYear) {
+        std::forward<F>(run)(Pipeline<YearFrom<KnownFromYear>, HashKey, Sha1Hasher>());
+    } else {
+        std::forward<F>(run)(Pipeline<YearFromRuntime, HashKey, Sha1Hasher>{ { fromYear }, {}, {} });
+    }
+}
+
+} // namespace pipeline
+
+#endif
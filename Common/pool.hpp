@@ -0,0 +1,67 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+// Reusable per-thread scratch memory for the worker hot path. A buffer grows
+// to the largest record it has seen and is then reused, so formatting hash
+// input or MPI messages stops allocating once the first records are through.
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace pool {
+
+class ScratchBuffer {
+public:
+    void clear() { used = 0; }
+
+    char *data() { return buffer.data(); }
+
+    int size() const { return used; }
+
+    void append(const void *bytes, int n) {
+        reserve(used + n);
+        memcpy(buffer.data() + used, bytes, n);
+        used += n;
+    }
+
+    // printf-style append, e.g. appendf("%d%f", year, mileage).
+    void appendf(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        va_list retry;
+        va_copy(retry, args);
+        reserve(used + 64);
+        int n = vsnprintf(buffer.data() + used, buffer.size() - used, format, args);
+        if (n >= (int)(buffer.size() - used)) {
+            reserve(used + n + 1);
+            vsnprintf(buffer.data() + used, buffer.size() - used, format, retry);
+        }
+        va_end(retry);
+        va_end(args);
+        used += n;
+    }
+
+private:
+    std::vector<char> buffer;
+    int used = 0;
+
+    void reserve(int n) {
+        if (n > (int)buffer.size()) {
+            buffer.resize(n * 2);
+        }
+    }
+};
+
+// One buffer per thread and slot; slots let a thread keep e.g. an input and
+// an output buffer alive at the same time.
+inline ScratchBuffer &scratch(int slot = 0) {
+    const int SLOTS = 4;
+    thread_local ScratchBuffer buffers[SLOTS];
+    return buffers[slot % SLOTS];
+}
+
+} // namespace pool
+
+#endif
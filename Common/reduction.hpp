@@ -0,0 +1,78 @@
+#ifndef REDUCTION_HPP
+#define REDUCTION_HPP
+
+// Exact year/mileage totals. Years are summed as 64-bit integers and mileage
+// as 128-bit fixed point with MILEAGE_FRACTION_BITS fractional bits, so every
+// partial sum is an integer and the totals come out bit-identical no matter
+// how the records are split across threads or ranks.
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace reduction {
+
+// Any mileage of at least 2^-11 converts without rounding; sums stay exact
+// up to 2^63.
+const int MILEAGE_FRACTION_BITS = 64;
+
+inline __int128 toFixed(double value) {
+    return (__int128)std::ldexp(value, MILEAGE_FRACTION_BITS);
+}
+
+struct Totals {
+    int64_t year = 0;
+    __int128 mileage = 0;
+
+    void add(int carYear, double carMileage) {
+        year += carYear;
+        mileage += toFixed(carMileage);
+    }
+
+    Totals &operator+=(const Totals &other) {
+        year += other.year;
+        mileage += other.mileage;
+        return *this;
+    }
+
+    // Rounded once, from the exact sum.
+    double mileageSum() const {
+        return std::ldexp((double)mileage, -MILEAGE_FRACTION_BITS);
+    }
+};
+
+// Totals of the records whose keep flag is set. The year sum is a plain
+// masked loop the compiler can vectorize; the 128-bit mileage sum stays scalar.
+template <class Record>
+Totals accumulate(const Record *cars, const unsigned char *keep, int n) {
+    Totals totals;
+
+    int64_t year = 0;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:year)
+#endif
+    for (int i = 0; i < n; i++) {
+        year += keep[i] ? cars[i].year : 0;
+    }
+    totals.year = year;
+
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) { totals.mileage += toFixed(cars[i].mileage); }
+    }
+
+    return totals;
+}
+
+// Combines per-thread partials pairwise, log2(n) levels deep.
+inline Totals combineTree(std::vector<Totals> partials) {
+    for (size_t stride = 1; stride < partials.size(); stride *= 2) {
+        for (size_t i = 0; i + stride < partials.size(); i += 2 * stride) {
+            partials[i] += partials[i + stride];
+        }
+    }
+    return partials.empty() ? Totals() : partials[0];
+}
+
+} // namespace reduction
+
+#endif
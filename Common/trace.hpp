@@ -0,0 +1,383 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+// Stage instrumentation shared by the host programs.
+// Compile with -DTRACE_ENABLED to record TSC-stamped spans, counters and
+// samples per thread; without it every TRACE_* macro expands to nothing.
+//
+//   TRACE_SCOPE("stage");               span until the end of the block
+//   TRACE_SPAN(var, "stage"); ...; TRACE_SPAN_END(var);
+//   TRACE_COUNT("counter", n);          per-thread counter
+//   TRACE_SAMPLE("queue", value);       time series (Chrome counter track)
+//   TRACE_THREAD_NAME("worker");        label for the current thread
+//   TRACE_SET_PROCESS(rank);            pid used in the trace (MPI rank)
+//   TRACE_WRITE("trace.json", "trace_summary.txt");
+//   TRACE_ALLOCS_BEGIN(var, "counter", warmupRecords);
+//   TRACE_ALLOCS_RECORDS(var, n); ...; TRACE_ALLOCS_END(var);
+//
+// The TRACE_ALLOCS_* check needs TRACE_COUNT_ALLOCATIONS as well. It replaces
+// the global operator new, so it may only be used in a program built from a
+// single translation unit. Once warmupRecords have been processed the calling
+// thread must not allocate any more: TRACE_ALLOCS_END aborts the run if it
+// did. Allocations made by the tracer itself are not counted.
+
+#ifdef TRACE_ENABLED
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace {
+
+// Events beyond this per-thread limit are dropped from the trace file, the
+// summary statistics still account for them.
+const size_t MAX_EVENTS = 1 << 20;
+
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+enum EventType { SPAN, SAMPLE };
+
+struct Event {
+    const char *name;
+    EventType type;
+    uint64_t start;
+    uint64_t value; // end tick for spans, sampled value otherwise
+};
+
+struct Stat {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+
+    void add(uint64_t v) {
+        count++;
+        total += v;
+        if (v < min) { min = v; }
+        if (v > max) { max = v; }
+    }
+};
+
+// Set while the tracer updates its own bookkeeping, so those allocations are
+// not charged to the traced code.
+inline bool &inTracer() {
+    thread_local bool active = false;
+    return active;
+}
+
+class TracerScope {
+public:
+    TracerScope() : outer(inTracer()) { inTracer() = true; }
+
+    ~TracerScope() { inTracer() = outer; }
+
+private:
+    bool outer;
+};
+
+struct ThreadLog {
+    int tid;
+    std::string name;
+    std::vector<Event> events;
+    std::map<const char *, Stat> spans;
+    std::map<const char *, Stat> samples;
+    std::map<const char *, uint64_t> counters;
+
+    void addSpan(const char *stage, uint64_t start, uint64_t end) {
+        TracerScope scope;
+        if (events.size() < MAX_EVENTS) {
+            events.push_back({stage, SPAN, start, end});
+        }
+        spans[stage].add(end - start);
+    }
+
+    void sample(const char *series, uint64_t value) {
+        TracerScope scope;
+        if (events.size() < MAX_EVENTS) {
+            events.push_back({series, SAMPLE, now(), value});
+        }
+        samples[series].add(value);
+    }
+
+    void count(const char *counter, uint64_t n) {
+        TracerScope scope;
+        counters[counter] += n;
+    }
+};
+
+struct Registry {
+    std::mutex mtx;
+    std::vector<std::unique_ptr<ThreadLog>> logs;
+    int pid = 0;
+    uint64_t startTicks = now();
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+};
+
+inline Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+inline ThreadLog &local() {
+    thread_local ThreadLog *log = nullptr;
+    if (log == nullptr) {
+        TracerScope scope;
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock{ r.mtx };
+        r.logs.emplace_back(new ThreadLog());
+        log = r.logs.back().get();
+        log->tid = r.logs.size() - 1;
+        log->name = "thread " + std::to_string(log->tid);
+        log->events.reserve(1 << 16);
+    }
+    return *log;
+}
+
+inline uint64_t &allocations() {
+    thread_local uint64_t count = 0;
+    return count;
+}
+
+// Fails the run when the calling thread still allocates after the first
+// warmupRecords records, i.e. once buffers should have reached their size.
+class AllocationCheck {
+public:
+    AllocationCheck(const char *_name, uint64_t _warmupRecords)
+            : name(_name), warmupRecords(_warmupRecords), records(0), start(0) {}
+
+    void processed(uint64_t n) {
+        if (records < warmupRecords && records + n >= warmupRecords) {
+            start = allocations();
+        }
+        records += n;
+    }
+
+    void finish() {
+        uint64_t checked = records > warmupRecords ? records - warmupRecords : 0;
+        uint64_t steady = checked > 0 ? allocations() - start : 0;
+        ThreadLog &log = local();
+        log.count(name, steady);
+        if (steady > 0) {
+            fprintf(stderr, "%s: %s: %llu heap allocations after the first %llu records\n",
+                    log.name.c_str(), name, (unsigned long long)steady,
+                    (unsigned long long)warmupRecords);
+            std::abort();
+        }
+    }
+
+private:
+    const char *name;
+    uint64_t warmupRecords;
+    uint64_t records;
+    uint64_t start;
+};
+
+class Span {
+public:
+    // The registry holds the tick origin, so it has to exist before the
+    // first timestamp is taken.
+    explicit Span(const char *_name) : name(_name), open(true) {
+        registry();
+        start = now();
+    }
+
+    ~Span() { end(); }
+
+    void end() {
+        if (!open) { return; }
+        open = false;
+        local().addSpan(name, start, now());
+    }
+
+private:
+    const char *name;
+    uint64_t start;
+    bool open;
+};
+
+// Ticks per microsecond, measured over the whole run.
+inline double ticksPerUs() {
+    Registry &r = registry();
+    double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - r.startTime).count();
+    double ticks = now() - r.startTicks;
+    return (us > 0 && ticks > 0) ? ticks / us : 1.0;
+}
+
+inline void writeChromeTrace(const std::string &file, double tpu) {
+    Registry &r = registry();
+    std::ofstream output(file);
+
+    output << "{\"traceEvents\":[" << std::endl;
+    bool first = true;
+    output << std::fixed << std::setprecision(3);
+    for (auto &log : r.logs) {
+        output << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"
+            << r.pid << ",\"tid\":" << log->tid << ",\"args\":{\"name\":\""
+            << log->name << "\"}}";
+        first = false;
+        for (Event &e : log->events) {
+            double ts = (e.start - r.startTicks) / tpu;
+            output << ",\n{\"name\":\"" << e.name << "\",\"pid\":" << r.pid
+                << ",\"tid\":" << log->tid << ",\"ts\":" << ts;
+            if (e.type == SPAN) {
+                output << ",\"ph\":\"X\",\"dur\":" << (e.value - e.start) / tpu << "}";
+            } else {
+                output << ",\"ph\":\"C\",\"args\":{\"value\":" << e.value << "}}";
+            }
+        }
+    }
+    output << std::endl << "]}" << std::endl;
+
+    output.close();
+}
+
+inline void writeSummary(const std::string &file, double tpu) {
+    const int ThreadWidth = 12;
+    const int NameWidth = 32;
+    const int NumWidth = 12;
+    const char HorizontalSeparator = '-';
+    const int HLength = ThreadWidth + NameWidth + NumWidth * 5 + 21;
+    const char *VerticalSeparator = " | ";
+
+    Registry &r = registry();
+    std::ofstream output(file);
+
+    output << std::left << "Stage timings (us), process " << r.pid << std::endl;
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+    output << std::right << std::setw(ThreadWidth) << "Thread" << VerticalSeparator
+        << std::setw(NameWidth) << "Stage" << VerticalSeparator
+        << std::setw(NumWidth) << "Count" << VerticalSeparator
+        << std::setw(NumWidth) << "Total" << VerticalSeparator
+        << std::setw(NumWidth) << "Mean" << VerticalSeparator
+        << std::setw(NumWidth) << "Min" << VerticalSeparator
+        << std::setw(NumWidth) << "Max" << VerticalSeparator << std::endl;
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+    output << std::fixed << std::setprecision(2);
+    for (auto &log : r.logs) {
+        for (auto &span : log->spans) {
+            const Stat &s = span.second;
+            output << std::right << std::setw(ThreadWidth) << log->name << VerticalSeparator
+                << std::setw(NameWidth) << span.first << VerticalSeparator
+                << std::setw(NumWidth) << s.count << VerticalSeparator
+                << std::setw(NumWidth) << s.total / tpu << VerticalSeparator
+                << std::setw(NumWidth) << s.total / tpu / s.count << VerticalSeparator
+                << std::setw(NumWidth) << s.min / tpu << VerticalSeparator
+                << std::setw(NumWidth) << s.max / tpu << VerticalSeparator << std::endl;
+        }
+    }
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+
+    output << std::left << "Samples" << std::endl;
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+    for (auto &log : r.logs) {
+        for (auto &series : log->samples) {
+            const Stat &s = series.second;
+            output << std::right << std::setw(ThreadWidth) << log->name << VerticalSeparator
+                << std::setw(NameWidth) << series.first << VerticalSeparator
+                << std::setw(NumWidth) << s.count << VerticalSeparator
+                << std::setw(NumWidth) << "" << VerticalSeparator
+                << std::setw(NumWidth) << (double)s.total / s.count << VerticalSeparator
+                << std::setw(NumWidth) << s.min << VerticalSeparator
+                << std::setw(NumWidth) << s.max << VerticalSeparator << std::endl;
+        }
+    }
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+
+    output << std::left << "Counters" << std::endl;
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+    for (auto &log : r.logs) {
+        for (auto &counter : log->counters) {
+            output << std::right << std::setw(ThreadWidth) << log->name << VerticalSeparator
+                << std::setw(NameWidth) << counter.first << VerticalSeparator
+                << std::setw(NumWidth) << counter.second << VerticalSeparator << std::endl;
+        }
+    }
+    output << std::string(HLength, HorizontalSeparator) << std::endl;
+
+    output.close();
+}
+
+// Must be called after all traced threads have been joined.
+inline void write(const std::string &traceFile, const std::string &summaryFile) {
+    double tpu = ticksPerUs();
+    writeChromeTrace(traceFile, tpu);
+    writeSummary(summaryFile, tpu);
+}
+
+} // namespace trace
+
+#ifdef TRACE_COUNT_ALLOCATIONS
+#ifdef __GNUC__
+// Kept out of line so GCC does not pair the inlined free() with new
+#define TRACE_NOINLINE __attribute__((noinline))
+#else
+#define TRACE_NOINLINE
+#endif
+
+TRACE_NOINLINE void *operator new(std::size_t size) {
+    if (!trace::inTracer()) { trace::allocations()++; }
+    if (void *p = std::malloc(size ? size : 1)) { return p; }
+    throw std::bad_alloc();
+}
+
+TRACE_NOINLINE void operator delete(void *p) noexcept { std::free(p); }
+
+TRACE_NOINLINE void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+#endif
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Span TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_SPAN(var, name) trace::Span var(name)
+#define TRACE_SPAN_END(var) var.end()
+#define TRACE_COUNT(name, n) trace::local().count(name, n)
+#define TRACE_SAMPLE(name, value) trace::local().sample(name, value)
+#define TRACE_THREAD_NAME(label) (trace::local().name = (label))
+#define TRACE_SET_PROCESS(id) (trace::registry().pid = (id))
+#define TRACE_WRITE(traceFile, summaryFile) trace::write(traceFile, summaryFile)
+#ifdef TRACE_COUNT_ALLOCATIONS
+#define TRACE_ALLOCS_BEGIN(var, name, warmupRecords) trace::AllocationCheck var(name, warmupRecords)
+#define TRACE_ALLOCS_RECORDS(var, n) var.processed(n)
+#define TRACE_ALLOCS_END(var) var.finish()
+#else
+#define TRACE_ALLOCS_BEGIN(var, name, warmupRecords) ((void)0)
+#define TRACE_ALLOCS_RECORDS(var, n) ((void)0)
+#define TRACE_ALLOCS_END(var) ((void)0)
+#endif
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_SPAN(var, name) ((void)0)
+#define TRACE_SPAN_END(var) ((void)0)
+#define TRACE_COUNT(name, n) ((void)0)
+#define TRACE_SAMPLE(name, value) ((void)0)
+#define TRACE_THREAD_NAME(label) ((void)0)
+#define TRACE_SET_PROCESS(id) ((void)0)
+#define TRACE_WRITE(traceFile, summaryFile) ((void)0)
+#define TRACE_ALLOCS_BEGIN(var, name, warmupRecords) ((void)0)
+#define TRACE_ALLOCS_RECORDS(var, n) ((void)0)
+#define TRACE_ALLOCS_END(var) ((void)0)
+
+#endif
+
+#endif
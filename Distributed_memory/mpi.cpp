@@ -2,53 +2,63 @@
 // Additional libraries used:
 // https://github.com/nlohmann/json
 #include "json.hpp"
-// https://github.com/vog/sha1
-#include "sha1-master/sha1.hpp"
+#include "../Common/async_io.hpp"
+#include "../Common/pipeline.hpp"
+#include "../Common/reduction.hpp"
+#include "../Common/trace.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
 const string INPUT_FILE = "input.json";
 const string OUTPUT_FILE = "output.txt";
+const string TRACE_FILE_PREFIX = "trace_rank";
 
 const int FILTER_FROM_YEAR = 2000; // File year range [1964;2021]
+const int ALLOC_CHECK_WARMUP = 64; // Records a worker may allocate for (TRACE_COUNT_ALLOCATIONS)
 
 struct Car {
     string name;
     int year;
     double mileage;
-    string hash;
+    char hash[digest::SHA1_HEX_LENGTH + 1];
 
     Car(string _name = "", int _year = 0, double _mileage = 0.0,
-            string _hash = "") {
+            const char *_hash = "") {
         name = _name;
         year = _year;
         mileage = _mileage;
-        hash = _hash;
+        strncpy(hash, _hash, sizeof(hash));
+        hash[sizeof(hash) - 1] = 0;
     }
 
-    string to_json() {
-        json j;
-        j["name"] = name;
-        j["year"] = year;
-        j["mileage"] = mileage;
-        j["hash"] = hash;
-        return j.dump();
+    // Message layout: year, mileage, hash, then the name filling the rest of
+    // the message. Written into a reused buffer so sending does not allocate.
+    void serialize(pool::ScratchBuffer &out) const {
+        out.clear();
+        out.append(&year, sizeof(year));
+        out.append(&mileage, sizeof(mileage));
+        out.append(hash, sizeof(hash));
+        out.append(name.data(), name.size());
     }
 
-    static Car from_json(const string &json_string) {
-        auto parsed = json::parse(json_string);
-        return {parsed["name"], parsed["year"], parsed["mileage"], parsed["hash"]};
+    // Reuses this record's name capacity instead of building a new Car.
+    void deserialize(const char *entry, int entrySize) {
+        const int header = sizeof(year) + sizeof(mileage) + sizeof(hash);
+        memcpy(&year, entry, sizeof(year));
+        memcpy(&mileage, entry + sizeof(year), sizeof(mileage));
+        memcpy(hash, entry + sizeof(year) + sizeof(mileage), sizeof(hash));
+        name.assign(entry + header, entrySize - header);
     }
 
     bool operator==(const Car &_car) {
         return (!name.compare(_car.name) && year == _car.year &&
-                mileage == _car.mileage && !hash.compare(_car.hash));
+                mileage == _car.mileage && !strcmp(hash, _car.hash));
     }
 
     bool operator!=(const Car &_car) {
         return (name.compare(_car.name) || year != _car.year ||
-                mileage != _car.mileage || hash.compare(_car.hash));
+                mileage != _car.mileage || strcmp(hash, _car.hash));
     }
 };
 
@@ -70,21 +80,28 @@ const int REJECT = 201;
 const int REQUEST_SIZE = 1;
 
 vector<Car> readData();
-void mainProcess(vector<Car> cars, vector<Car> results);
+void mainProcess(const vector<Car> &cars, bool writerThreads);
 void dataProcess(int bufSize, const int workerCount);
-void resultProcess(int bufSize, const int workerCount);
-void workerProcess();
-void computeHash(Car &car);
-void insertItem(Car *cars, int &bufSize, Car item);
-void writeInitialData(vector<Car> cars);
-void writeRes(vector<Car> cars);
-
-int main() {
-    vector<Car> cars = readData();
-    vector<Car> results;
-    results.reserve(cars.size());
-
-    MPI::Init();
+template <class Pipeline>
+void resultProcess(const Pipeline &pipeline, int bufSize, const int workerCount);
+template <class Pipeline>
+reduction::Totals workerProcess(const Pipeline &pipeline);
+template <class Pipeline>
+void insertItem(const Pipeline &pipeline, Car *cars, int &bufSize, Car item);
+void writeInitialData(const vector<Car> &cars);
+void writeResHeader(ostream &output);
+void writeResRows(ostream &output, const Car *cars, int n);
+void writeResFooter(ostream &output);
+void addTotals(const void *in, void *inout, int len, const MPI::Datatype &datatype);
+reduction::Totals allreduceTotals(const reduction::Totals &local);
+void writeTotals(const reduction::Totals &totals);
+
+int main(int argc, char *argv[]) {
+    int filterFromYear = (argc > 1) ? atoi(argv[1]) : FILTER_FROM_YEAR;
+
+    // Only the main process calls MPI, its writer threads do plain file I/O.
+    // An MPI without THREAD_FUNNELED support gets no extra threads at all.
+    bool writerThreads = MPI::Init_thread(MPI::THREAD_FUNNELED) >= MPI::THREAD_FUNNELED;
     int rank = MPI::COMM_WORLD.Get_rank();
     if (MPI::COMM_WORLD.Get_size() < 4) {
         if (rank == MAIN_PROC) {
@@ -94,23 +111,46 @@ int main() {
         return 1;
     }
 
+    // Only the main process needs the records, the others just size their buffers
+    vector<Car> cars;
+    int carCount = 0;
+    if (rank == MAIN_PROC) {
+        cars = readData();
+        carCount = cars.size();
+    }
+    MPI::COMM_WORLD.Bcast(&carCount, 1, MPI::INT, MAIN_PROC);
+
+    TRACE_SET_PROCESS(rank);
     const int workerCount = MPI::COMM_WORLD.Get_size() - 3;
+    reduction::Totals localTotals;
+    pipeline::dispatchYearFilter<FILTER_FROM_YEAR>(filterFromYear, [&](auto pipeline) {
+        if (rank == MAIN_PROC) {
+            mainProcess(cars, writerThreads);
+        } else if (rank == DATA_PROC) {
+            dataProcess(carCount / 2, workerCount);
+        } else if (rank == RESULT_PROC) {
+            resultProcess(pipeline, carCount, workerCount);
+        } else if (rank >= WORKER_PROC) {
+            localTotals = workerProcess(pipeline);
+        }
+    });
+
+    // Only workers contribute, every rank takes part in the collective
+    reduction::Totals totals = allreduceTotals(localTotals);
     if (rank == MAIN_PROC) {
-        mainProcess(cars, results);
-    } else if (rank == DATA_PROC) {
-        dataProcess(cars.size() / 2, workerCount);
-    } else if (rank == RESULT_PROC) {
-        resultProcess(cars.size(), workerCount);
-    } else if (rank >= WORKER_PROC) {
-        workerProcess();
+        writeTotals(totals);
     }
 
+    TRACE_WRITE(TRACE_FILE_PREFIX + to_string(rank) + ".json",
+            TRACE_FILE_PREFIX + to_string(rank) + "_summary.txt");
+
     MPI::Finalize();
 
     return 0;
 }
 
 vector<Car> readData() {
+    TRACE_SCOPE("readData");
     vector<Car> cars;
 
     ifstream f(INPUT_FILE);
@@ -131,63 +171,88 @@ vector<Car> readData() {
     return cars;
 }
 
-void mainProcess(vector<Car> cars, vector<Car> results) {
-    writeInitialData(cars);
+void mainProcess(const vector<Car> &cars, bool writerThreads) {
+    TRACE_THREAD_NAME("main");
+    // The initial data does not depend on the results, write it while distributing
+    thread initialWriter;
+    if (writerThreads) {
+        initialWriter = thread(writeInitialData, cref(cars));
+    } else {
+        writeInitialData(cars);
+    }
 
     for (int i = 0; i < cars.size();) {
         int request = INSERT;
         MPI::COMM_WORLD.Send(&request, REQUEST_SIZE, MPI::INT, DATA_PROC, TO_DATA);
+        TRACE_SPAN(recv, "MPI Recv");
         MPI::COMM_WORLD.Recv(&request, REQUEST_SIZE, MPI::INT, DATA_PROC, TO_MAIN);
+        TRACE_SPAN_END(recv);
         if (request != ACCEPT) {
+            TRACE_COUNT("mainProcess REJECT retries", 1);
             continue;
         }
 
-        string serialized = cars[i].to_json();
-        int entrySize = serialized.size();
-        const char *entry = serialized.c_str();
-        MPI::COMM_WORLD.Send(entry, entrySize, MPI::CHAR, DATA_PROC, TO_DATA);
+        pool::ScratchBuffer &message = pool::scratch();
+        cars[i].serialize(message);
+        MPI::COMM_WORLD.Send(message.data(), message.size(), MPI::BYTE, DATA_PROC, TO_DATA);
         i++;
     }
     MPI::COMM_WORLD.Send(&END, REQUEST_SIZE, MPI::INT, DATA_PROC, TO_DATA);
+    if (initialWriter.joinable()) {
+        initialWriter.join();
+    }
 
+    // Results are formatted as they arrive and written behind the receive loop
+    async_io::AsyncWriter writer(OUTPUT_FILE, ios_base::app, writerThreads);
+    writeResHeader(writer.stream());
+    Car car;
     while (true) {
         MPI::Status status;
+        TRACE_SPAN(probe, "MPI Probe");
         MPI::COMM_WORLD.Probe(RESULT_PROC, TO_MAIN, status);
-        int entrySize = status.Get_count(MPI::CHAR);
+        TRACE_SPAN_END(probe);
+        int entrySize = status.Get_count(MPI::BYTE);
         char entry[entrySize];
-        MPI::COMM_WORLD.Recv(entry, entrySize, MPI::CHAR, RESULT_PROC, TO_MAIN);
+        TRACE_SPAN(recv, "MPI Recv");
+        MPI::COMM_WORLD.Recv(entry, entrySize, MPI::BYTE, RESULT_PROC, TO_MAIN);
+        TRACE_SPAN_END(recv);
         if (entrySize == 0) {
             break;
         }
 
-        Car car = Car::from_json(string(entry, entry + entrySize));
-        results.push_back(car);
+        car.deserialize(entry, entrySize);
+        writeResRows(writer.stream(), &car, 1);
+        writer.flushIfFull();
     }
-    writeRes(results);
+    writeResFooter(writer.stream());
+    writer.close();
 }
 
 void dataProcess(int bufSize, const int workerCount) {
+    TRACE_THREAD_NAME("data");
     Car *buffer = new Car[bufSize];
     int count = 0;
     bool isDataSending = true;
     while (isDataSending || count > 0) {
         MPI::Status status;
+        TRACE_SPAN(probe, "MPI Probe");
         MPI::COMM_WORLD.Probe(MPI::ANY_SOURCE, TO_DATA, status);
+        TRACE_SPAN_END(probe);
         int source = status.Get_source();
         int request;
         MPI::COMM_WORLD.Recv(&request, REQUEST_SIZE, MPI::INT, source, TO_DATA);
+        TRACE_SAMPLE("data buffer occupancy", count);
 
         if (request == INSERT) {
             if (count < bufSize) {
                 MPI::COMM_WORLD.Send(&ACCEPT, REQUEST_SIZE, MPI::INT, source, TO_MAIN);
 
                 MPI::COMM_WORLD.Probe(source, TO_DATA, status);
-                int entrySize = status.Get_count(MPI::CHAR);
+                int entrySize = status.Get_count(MPI::BYTE);
                 char entry[entrySize];
-                MPI::COMM_WORLD.Recv(entry, entrySize, MPI::CHAR, source, TO_DATA);
+                MPI::COMM_WORLD.Recv(entry, entrySize, MPI::BYTE, source, TO_DATA);
 
-                Car car = Car::from_json(string(entry, entry + entrySize));
-                buffer[count++] = car;
+                buffer[count++].deserialize(entry, entrySize);
             } else {
                 MPI::COMM_WORLD.Send(&REJECT, REQUEST_SIZE, MPI::INT, source, TO_MAIN);
             }
@@ -196,11 +261,11 @@ void dataProcess(int bufSize, const int workerCount) {
                 MPI::COMM_WORLD.Send(&ACCEPT, REQUEST_SIZE, MPI::INT, source,
                         TO_WORKER);
 
-                string serialized = buffer[--count].to_json();
-                int entrySize = serialized.size();
-                const char *entry = serialized.c_str();
+                pool::ScratchBuffer &message = pool::scratch();
+                buffer[--count].serialize(message);
 
-                MPI::COMM_WORLD.Send(entry, entrySize, MPI::CHAR, source, TO_WORKER);
+                MPI::COMM_WORLD.Send(message.data(), message.size(), MPI::BYTE, source,
+                        TO_WORKER);
             } else {
                 MPI::COMM_WORLD.Send(&REJECT, REQUEST_SIZE, MPI::INT, source,
                         TO_WORKER);
@@ -218,90 +283,111 @@ void dataProcess(int bufSize, const int workerCount) {
     delete[] buffer;
 }
 
-void resultProcess(int bufSize, const int workerCount) {
+template <class Pipeline>
+void resultProcess(const Pipeline &pipeline, int bufSize, const int workerCount) {
+    TRACE_THREAD_NAME("result");
     Car *buffer = new Car[bufSize];
     int count = 0;
     int workersFinished = 0;
+    Car car;
 
     while (true) {
         MPI::Status status;
+        TRACE_SPAN(probe, "MPI Probe");
         MPI::COMM_WORLD.Probe(MPI::ANY_SOURCE, TO_RES, status);
-        int entrySize = status.Get_count(MPI::CHAR);
+        TRACE_SPAN_END(probe);
+        int entrySize = status.Get_count(MPI::BYTE);
         int source = status.Get_source();
         if (entrySize != 0) {
             char entry[entrySize];
-            MPI::COMM_WORLD.Recv(entry, entrySize, MPI::CHAR, source, TO_RES);
-            Car car = Car::from_json(string(entry, entry + entrySize));
-            insertItem(buffer, count, car);
+            TRACE_SPAN(recv, "MPI Recv");
+            MPI::COMM_WORLD.Recv(entry, entrySize, MPI::BYTE, source, TO_RES);
+            TRACE_SPAN_END(recv);
+            car.deserialize(entry, entrySize);
+            TRACE_SPAN(insert, "insertItem");
+            insertItem(pipeline, buffer, count, move(car));
+            TRACE_SPAN_END(insert);
+            TRACE_SAMPLE("result buffer occupancy", count);
         } else if (entrySize == 0) {
-            MPI::COMM_WORLD.Recv(NULL, 0, MPI::CHAR, source, TO_RES);
+            MPI::COMM_WORLD.Recv(NULL, 0, MPI::BYTE, source, TO_RES);
             if (++workersFinished >= workerCount) {
                 break;
             }
         }
     }
 
+    pool::ScratchBuffer &message = pool::scratch();
     for (int i = 0; i < count; i++) {
-        string serialized = buffer[i].to_json();
-        int entrySize = serialized.size();
-        const char *entry = serialized.c_str();
-        MPI::COMM_WORLD.Send(entry, entrySize, MPI::CHAR, MAIN_PROC, TO_MAIN);
+        buffer[i].serialize(message);
+        MPI::COMM_WORLD.Send(message.data(), message.size(), MPI::BYTE, MAIN_PROC, TO_MAIN);
     }
-    MPI::COMM_WORLD.Send(0, 0, MPI::CHAR, MAIN_PROC, TO_MAIN);
+    MPI::COMM_WORLD.Send(0, 0, MPI::BYTE, MAIN_PROC, TO_MAIN);
 
     delete[] buffer;
 }
 
-void workerProcess() {
+template <class Pipeline>
+reduction::Totals workerProcess(const Pipeline &pipeline) {
+    TRACE_THREAD_NAME("worker");
+    reduction::Totals totals;
+    Car car;
+    pool::ScratchBuffer &message = pool::scratch();
+    TRACE_ALLOCS_BEGIN(allocs, "worker steady-state allocations", ALLOC_CHECK_WARMUP);
     while (true) {
         int request = REMOVE;
         MPI::COMM_WORLD.Send(&request, REQUEST_SIZE, MPI::INT, DATA_PROC, TO_DATA);
+        TRACE_SPAN(reply, "MPI Recv");
         MPI::COMM_WORLD.Recv(&request, REQUEST_SIZE, MPI::INT, DATA_PROC,
                 TO_WORKER);
+        TRACE_SPAN_END(reply);
         if (request == END) {
-            MPI::COMM_WORLD.Send(0, 0, MPI::CHAR, RESULT_PROC, TO_RES);
+            MPI::COMM_WORLD.Send(0, 0, MPI::BYTE, RESULT_PROC, TO_RES);
             break;
         } else if (request != ACCEPT) {
+            TRACE_COUNT("workerProcess REJECT retries", 1);
             continue;
         }
 
         MPI::Status status;
+        TRACE_SPAN(probe, "MPI Probe");
         MPI::COMM_WORLD.Probe(DATA_PROC, TO_WORKER, status);
-        int entrySize = status.Get_count(MPI::CHAR);
+        TRACE_SPAN_END(probe);
+        int entrySize = status.Get_count(MPI::BYTE);
         char entry[entrySize];
-        MPI::COMM_WORLD.Recv(entry, entrySize, MPI::CHAR, DATA_PROC, TO_WORKER);
-
-        Car car = Car::from_json(string(entry, entry + entrySize));
-        computeHash(car);
-        if (car != Car()) {
-            string serialized = car.to_json();
-            entrySize = serialized.size();
-            const char *entry = serialized.c_str();
-            MPI::COMM_WORLD.Send(entry, entrySize, MPI::CHAR, RESULT_PROC, TO_RES);
+        TRACE_SPAN(recv, "MPI Recv");
+        MPI::COMM_WORLD.Recv(entry, entrySize, MPI::BYTE, DATA_PROC, TO_WORKER);
+        TRACE_SPAN_END(recv);
+
+        car.deserialize(entry, entrySize);
+        bool keep;
+        {
+            TRACE_SCOPE("computeHash SHA-1");
+            keep = pipeline.process(car);
+        }
+        if (keep) {
+            totals.add(car.year, car.mileage);
+            car.serialize(message);
+            MPI::COMM_WORLD.Send(message.data(), message.size(), MPI::BYTE, RESULT_PROC,
+                    TO_RES);
         }
+        TRACE_ALLOCS_RECORDS(allocs, 1);
     }
-}
-
-void computeHash(Car &car) {
-    SHA1 sha;
-    sha.update(car.name + to_string(car.year) + to_string(car.mileage));
-    car.hash = sha.final();
+    TRACE_ALLOCS_END(allocs);
 
-    if (FILTER_FROM_YEAR <= car.year) {
-        return;
-    }
-    car = Car();
+    return totals;
 }
 
-void insertItem(Car *cars, int &bufSize, Car item) {
+template <class Pipeline>
+void insertItem(const Pipeline &pipeline, Car *cars, int &bufSize, Car item) {
     int i = 0;
-    for (i = bufSize++; i > 0 && cars[i - 1].hash.compare(item.hash) > 0; i--) {
-        cars[i] = cars[i - 1];
+    for (i = bufSize++; i > 0 && pipeline.before(item, cars[i - 1]); i--) {
+        cars[i] = move(cars[i - 1]);
     }
-    cars[i] = item;
+    cars[i] = move(item);
 }
 
-void writeInitialData(vector<Car> cars) {
+void writeInitialData(const vector<Car> &cars) {
+    TRACE_SCOPE("writeInitialData");
     const int NameWidth = 25;
     const int YearWidth = 5;
     const int MileageWidth = 10;
@@ -320,7 +406,7 @@ void writeInitialData(vector<Car> cars) {
         << VerticalSeparator << endl;
     output << string(HLength, HorizontalSeparator) << endl;
     for (int i = 0; i < cars.size(); i++) {
-        Car car = cars[i];
+        const Car &car = cars[i];
         output << right << setw(NameWidth) << car.name << VerticalSeparator
             << setw(YearWidth) << car.year << VerticalSeparator << fixed
             << setprecision(2) << setw(MileageWidth) << car.mileage
@@ -332,7 +418,7 @@ void writeInitialData(vector<Car> cars) {
     output.close();
 }
 
-void writeRes(vector<Car> cars) {
+void writeResHeader(ostream &output) {
     const int NameWidth = 25;
     const int YearWidth = 5;
     const int MileageWidth = 10;
@@ -341,8 +427,6 @@ void writeRes(vector<Car> cars) {
     const int HLength = NameWidth + YearWidth + MileageWidth + HashWidth + 11;
     const char *VerticalSeparator = " | ";
 
-    ofstream output(OUTPUT_FILE, ios_base::app);
-
     output << left << "Results" << endl;
     output << string(HLength, HorizontalSeparator) << endl;
     output << right << setw(NameWidth) << "Name" << VerticalSeparator
@@ -350,15 +434,65 @@ void writeRes(vector<Car> cars) {
         << "Mileage" << VerticalSeparator << setw(HashWidth) << "Hash"
         << VerticalSeparator << endl;
     output << string(HLength, HorizontalSeparator) << endl;
-    for (int i = 0; i < cars.size(); i++) {
-        Car car = cars[i];
+}
+
+void writeResRows(ostream &output, const Car *cars, int n) {
+    TRACE_SCOPE("writeRes");
+    const int NameWidth = 25;
+    const int YearWidth = 5;
+    const int MileageWidth = 10;
+    const int HashWidth = 41;
+    const char *VerticalSeparator = " | ";
+
+    for (int i = 0; i < n; i++) {
+        const Car &car = cars[i];
         output << right << setw(NameWidth) << car.name << VerticalSeparator
             << setw(YearWidth) << car.year << VerticalSeparator << fixed
             << setprecision(2) << setw(MileageWidth) << car.mileage
             << VerticalSeparator << setw(HashWidth) << car.hash
             << VerticalSeparator << endl;
     }
+}
+
+void writeResFooter(ostream &output) {
+    const int NameWidth = 25;
+    const int YearWidth = 5;
+    const int MileageWidth = 10;
+    const int HashWidth = 41;
+    const char HorizontalSeparator = '-';
+    const int HLength = NameWidth + YearWidth + MileageWidth + HashWidth + 11;
+
     output << string(HLength, HorizontalSeparator) << endl;
+}
+
+void addTotals(const void *in, void *inout, int len, const MPI::Datatype &) {
+    const reduction::Totals *partial = (const reduction::Totals *)in;
+    reduction::Totals *total = (reduction::Totals *)inout;
+    for (int i = 0; i < len; i++) {
+        total[i] += partial[i];
+    }
+}
+
+reduction::Totals allreduceTotals(const reduction::Totals &local) {
+    MPI::Datatype type = MPI::BYTE.Create_contiguous(sizeof(reduction::Totals));
+    type.Commit();
+    MPI::Op op;
+    op.Init(addTotals, true);
+
+    reduction::Totals totals;
+    MPI::COMM_WORLD.Allreduce(&local, &totals, 1, type, op);
+
+    op.Free();
+    type.Free();
+
+    return totals;
+}
+
+void writeTotals(const reduction::Totals &totals) {
+    ofstream output(OUTPUT_FILE, ios_base::app);
+
+    output << fixed << setprecision(2) << "Year sum: " << totals.year
+        << ", mileage sum: " << totals.mileageSum() << endl;
 
     output.close();
 }
@@ -1,46 +1,69 @@
 #include <condition_variable>
+#include <iostream>
+#include <iterator>
 #include <thread>
+#include <tuple>
 // Additional libraries used:
 // https://github.com/nlohmann/json
 #include <nlohmann/json.hpp>
-// https://github.com/vog/sha1
-#include "sha1-master/sha1.hpp"
+#include "../Common/async_io.hpp"
+#include "../Common/numa.hpp"
+#include "../Common/pipeline.hpp"
+#include "../Common/trace.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
 const string INPUT_FILE = "input.json";
 const string OUTPUT_FILE = "output.txt";
+const string TRACE_FILE = "trace.json";
+const string TRACE_SUMMARY_FILE = "trace_summary.txt";
 
 const int THREAD_NUM = 2;
+const int BATCH_SIZE = 8; // Records moved through the data monitor per lock
+const int DATA_CAPACITY = 1024; // Records buffered between the reader and the workers
+const int ALLOC_CHECK_WARMUP = 64; // Records a worker may allocate for (TRACE_COUNT_ALLOCATIONS)
+// Give every NUMA node its own data monitor, allocated on that node, and pin
+// workers so they drain their local monitor before helping the others.
+// Has no effect on single-node hosts.
+const bool NUMA_AWARE = false;
 const int FILTER_FROM_YEAR = 2000; // Data range [1964;2021]
 
 struct Car {
 	string name;
 	int year;
 	double mileage;
-	string hash;
+	char hash[digest::SHA1_HEX_LENGTH + 1];
 
-	Car(string _name = "", int _year = 0, double _mileage = 0.0, string _hash = "") {
+	Car(string _name = "", int _year = 0, double _mileage = 0.0, const char* _hash = "") {
 		name = _name;
 		year = _year;
 		mileage = _mileage;
-		hash = _hash;
+		strncpy(hash, _hash, sizeof(hash));
+		hash[sizeof(hash) - 1] = 0;
 	}
 
 	bool operator== (const Car& _car) {
 		return (!name.compare(_car.name) && year == _car.year
-			&& mileage == _car.mileage && !hash.compare(_car.hash));
+			&& mileage == _car.mileage && !strcmp(hash, _car.hash));
 	}
 };
 
+// Bounded buffer with separate not-empty/not-full conditions. A producer that
+// fills the buffer up to highWatermark sleeps until consumers drain it down
+// to lowWatermark, so it is woken once per batch instead of once per item.
 class Monitor {
 public:
-	Monitor(int _capacity) {
-		arr = new Car[_capacity];
+	Monitor(int _capacity, int _lowWatermark = -1, int _highWatermark = -1) {
+		capacity = max(_capacity, 1);
+		arr = new Car[capacity];
 		count = 0;
-		capacity = _capacity;
+		requestedLowWatermark = _lowWatermark;
+		requestedHighWatermark = _highWatermark;
+		setWatermarks();
 		canBeFilled = 1;
+		producersWaiting = 0;
+		consumersWaiting = 0;
 	}
 
 	~Monitor() { delete[] arr; }
@@ -50,35 +73,103 @@ public:
 	bool isFull() { return (count == capacity); }
 
 	void addItem(Car newCar) {
-		unique_lock<mutex> lock{ mtx };
-		condVar.wait(lock, [this]() { return !isFull(); });
-
-		arr[count++] = newCar;
+		addItems(make_move_iterator(&newCar), 1);
+	}
 
-		condVar.notify_all();
+	// Copies n items from a pointer, or moves them when given make_move_iterator(items).
+	template <class Iterator>
+	void addItems(Iterator items, int n) {
+		int added = 0;
+		while (added < n) {
+			TRACE_SPAN(wait, "Monitor::addItems lock wait");
+			unique_lock<mutex> lock{ mtx };
+			if (count >= highWatermark) {
+				TRACE_COUNT("Monitor producer waits", 1);
+				producersWaiting++;
+				notFull.wait(lock, [this]() { return count <= lowWatermark; });
+				producersWaiting--;
+			}
+			TRACE_SPAN_END(wait);
+
+			int batch = min(n - added, highWatermark - count);
+			for (int i = 0; i < batch; i++, added++) {
+				arr[count++] = *items++;
+			}
+
+			// A consumer takes up to BATCH_SIZE items, wake one per consumer batch
+			int toWake = min((batch + BATCH_SIZE - 1) / BATCH_SIZE, consumersWaiting);
+			lock.unlock();
+			for (int i = 0; i < toWake; i++) {
+				notEmpty.notify_one();
+			}
+		}
 	}
 
-	void addItemSorted(Car newCar) {
+	template <class Pipeline>
+	void addItemSorted(Car newCar, const Pipeline& pipeline) {
+		TRACE_SPAN(wait, "Monitor::addItemSorted lock wait");
 		unique_lock<mutex> lock{ mtx };
+		TRACE_SPAN_END(wait);
 
-		insertItem(newCar);
+		// The producer reserves room for every record it hands out, see reserve()
+		insertItem(move(newCar), pipeline);
 
-		condVar.notify_all();
+		bool wake = consumersWaiting > 0;
+		lock.unlock();
+		if (wake) { notEmpty.notify_one(); }
 	}
 
 	Car removeItem() {
+		Car car;
+		if (removeItems(&car, 1) < 1) { return Car(); }
+
+		return car;
+	}
+
+	// Moves up to n items into out. Blocks while the buffer is empty and data
+	// is still being added, returns 0 once everything has been consumed.
+	int removeItems(Car* out, int n) {
+		TRACE_SPAN(wait, "Monitor::removeItems lock wait");
 		unique_lock<mutex> lock{ mtx };
+		if (count == 0 && canBeFilled) {
+			TRACE_COUNT("Monitor consumer waits", 1);
+			consumersWaiting++;
+			notEmpty.wait(lock, [this]() { return (count > 0 || !canBeFilled); });
+			consumersWaiting--;
+		}
+		TRACE_SPAN_END(wait);
+		TRACE_SAMPLE("Monitor occupancy", count);
 
-		condVar.wait(lock, [this]() { return (isFull() || !canBeFilled); });
+		int taken = min(n, count);
+		for (int i = 0; i < taken; i++) {
+			out[i] = move(arr[--count]);
+		}
 
-		if (count < 1) { return Car(); }
+		bool wake = producersWaiting > 0 && count <= lowWatermark;
+		lock.unlock();
+		if (wake) { notFull.notify_one(); }
 
-		Car car;
-		car = arr[--count];
+		return taken;
+	}
 
-		condVar.notify_all();
+	// Makes room for n items. Only called by the producer, before it hands out
+	// the records that could end up here, so consumers never grow the buffer
+	// and only the moves happen under the lock.
+	void reserve(int n) {
+		if (n <= capacity) { return; }
+		int larger = max(n, capacity * 2);
+		Car* moved = new Car[larger];
 
-		return car;
+		unique_lock<mutex> lock{ mtx };
+		for (int i = 0; i < count; i++) {
+			moved[i] = move(arr[i]);
+		}
+		swap(arr, moved);
+		capacity = larger;
+		setWatermarks();
+		lock.unlock();
+
+		delete[] moved;
 	}
 
 	Car get(int index) {
@@ -86,8 +177,10 @@ public:
 	}
 
 	void dataAddingEnded() {
+		unique_lock<mutex> lock{ mtx };
 		canBeFilled = 0;
-		condVar.notify_all();
+		lock.unlock();
+		notEmpty.notify_all();
 	}
 
 	bool isDataGettingAdded() {
@@ -102,93 +195,203 @@ private:
 	Car* arr;
 	int count;
 	int capacity;
+	int lowWatermark;
+	int highWatermark;
+	int requestedLowWatermark;
+	int requestedHighWatermark;
 
 	bool canBeFilled;
+	int producersWaiting;
+	int consumersWaiting;
 
 	mutex mtx;
-	condition_variable condVar;
+	condition_variable notEmpty;
+	condition_variable notFull;
+
+	// Derives the watermarks from the requested ones and the current capacity,
+	// -1 or an out-of-range value picks the default. Called with mtx held.
+	void setWatermarks() {
+		highWatermark = (requestedHighWatermark < 1 || requestedHighWatermark > capacity) ? capacity : requestedHighWatermark;
+		lowWatermark = (requestedLowWatermark < 0 || requestedLowWatermark >= highWatermark) ? highWatermark / 2 : requestedLowWatermark;
+	}
 
-	void insertItem(Car item) {
+	template <class Pipeline>
+	void insertItem(Car item, const Pipeline& pipeline) {
 		int i;
-		for (i = ++count - 1; i > 0 && arr[i - 1].hash.compare(item.hash) > 0; i--) {
-			arr[i] = arr[i - 1];
+		for (i = ++count - 1; i > 0 && pipeline.before(item, arr[i - 1]); i--) {
+			arr[i] = move(arr[i - 1]);
 		}
-		arr[i] = item;
+		arr[i] = move(item);
 	}
 };
 
-vector<Car> readData();
-void task(Monitor* dataMon, Monitor* resMon);
-void writeInitialData(vector<Car> cars);
-void writeRes(Monitor* resMon);
-
-int main() {
-	vector<Car> cars = readData();
+void readData(vector<Monitor*> dataMons, Monitor* resMon, async_io::AsyncWriter& writer);
+template <class Pipeline>
+void task(Pipeline pipeline, int idx, vector<Monitor*> dataMons, Monitor* resMon,
+	numa::AccessCounts* accesses);
+template <class Pipeline>
+void processBatch(const Pipeline& pipeline, Car* batch, int n, Monitor* resMon);
+void writeInitialHeader(ostream& output);
+void writeInitialRows(ostream& output, const Car* cars, int n);
+void writeInitialFooter(ostream& output);
+void writeRes(async_io::AsyncWriter& writer, Monitor* resMon);
+
+int main(int argc, char* argv[]) {
+	int filterFromYear = (argc > 1) ? atoi(argv[1]) : FILTER_FROM_YEAR;
+	async_io::AsyncWriter writer(OUTPUT_FILE);
 
 	vector<thread> threads(THREAD_NUM);
+	vector<numa::AccessCounts> accesses(THREAD_NUM);
+
+	// Every node's monitor needs at least one local worker to drain it
+	int nodeCount = NUMA_AWARE ? min(numa::nodeCount(), THREAD_NUM) : 1;
+	vector<Monitor*> dataMons(nodeCount);
+	if (nodeCount == 1) {
+		dataMons[0] = new Monitor(DATA_CAPACITY);
+	} else {
+		for (int node = 0; node < nodeCount; node++) {
+			// Constructed from a thread pinned to the node, so its buffer is first-touched there
+			thread([&dataMons, node, nodeCount]() {
+				numa::pinWorker(node, nodeCount);
+				dataMons[node] = new Monitor(DATA_CAPACITY / nodeCount);
+			}).join();
+		}
+	}
+	Monitor* resMon = new Monitor(DATA_CAPACITY);
 
-	Monitor* dataMon = new Monitor(cars.size() / 2);
-	Monitor* resMon = new Monitor(cars.size());
+	pipeline::dispatchYearFilter<FILTER_FROM_YEAR>(filterFromYear, [&](auto pipeline) {
+		for (int i = 0; i < THREAD_NUM; i++) {
+			threads[i] = thread(task<decltype(pipeline)>, pipeline, i, dataMons, resMon, &accesses[i]);
+		}
+	});
 
-	for (int i = 0; i < THREAD_NUM; i++) {
-		threads[i] = thread(task, dataMon, resMon);
-	}
+	TRACE_THREAD_NAME("main");
+	readData(dataMons, resMon, writer);
 
-	for (Car c : cars) {
-		dataMon->addItem(c);
+	for (Monitor* dataMon : dataMons) {
+		dataMon->dataAddingEnded();
 	}
 
-	dataMon->dataAddingEnded();
-
 	for_each(threads.begin(), threads.end(), mem_fn(&thread::join));
 
-	writeInitialData(cars);
-	writeRes(resMon);
+	long long localAccesses = 0;
+	long long remoteAccesses = 0;
+	for (numa::AccessCounts& a : accesses) {
+		localAccesses += a.local;
+		remoteAccesses += a.remote;
+	}
+	if (nodeCount > 1) {
+		cout << "NUMA nodes: " << nodeCount << ", local record accesses: " << localAccesses
+			<< ", remote: " << remoteAccesses << endl;
+	}
+
+	writeRes(writer, resMon);
+	writer.close();
+
+	TRACE_WRITE(TRACE_FILE, TRACE_SUMMARY_FILE);
 
-	delete dataMon;
+	for (Monitor* dataMon : dataMons) {
+		delete dataMon;
+	}
 	delete resMon;
 
 	return 0;
 }
 
-vector<Car> readData() {
-	vector<Car> cars;
+// Streams the input: every BATCH_SIZE parsed cars go to the workers and their
+// initial data rows to the writer thread, so reading, hashing and writing overlap.
+// The result count is not known up front, so the result monitor is grown here,
+// ahead of the records that could fill it.
+void readData(vector<Monitor*> dataMons, Monitor* resMon, async_io::AsyncWriter& writer) {
+	TRACE_SCOPE("readData");
+	ostream& output = writer.stream();
+	Car batch[BATCH_SIZE];
+	int n = 0;
+	int batches = 0;
+	int sent = 0;
+	auto sendBatch = [&]() {
+		writeInitialRows(output, batch, n);
+		writer.flushIfFull();
+		sent += n;
+		resMon->reserve(sent);
+		dataMons[batches++ % dataMons.size()]->addItems(make_move_iterator(batch), n);
+		n = 0;
+	};
+
+	writeInitialHeader(output);
 
 	ifstream f(INPUT_FILE);
-	json fileData = json::parse(f);
-
-	json carsData = fileData["cars"];
-	for (int i = 0; i < carsData.size(); i++) {
+	bool inCars = false;
+	// Everything is consumed by the callback, the returned document is not needed
+	ignore = json::parse(f, [&](int depth, json::parse_event_t event, json& parsed) {
+		if (event == json::parse_event_t::key && depth == 1) {
+			inCars = (parsed == "cars");
+		}
+		if (event != json::parse_event_t::object_end || depth != 2 || !inCars) {
+			return true;
+		}
 
-		Car newCar = {
-			carsData[i]["name"],
-			carsData[i]["year"],
-			carsData[i]["mileage"],
+		batch[n++] = {
+			parsed["name"],
+			parsed["year"],
+			parsed["mileage"],
 		};
+		if (n == BATCH_SIZE) { sendBatch(); }
 
-		cars.push_back(newCar);
-	}
+		// Parsed cars are not kept in the document
+		return false;
+	});
+	if (n > 0) { sendBatch(); }
 
-	return cars;
+	writeInitialFooter(output);
+	writer.flush();
 }
 
-void task(Monitor* dataMon, Monitor* resMon) {
-	while (dataMon->isDataGettingAdded() || dataMon->size() > 0) {
-		Car car = dataMon->removeItem();
+template <class Pipeline>
+void task(Pipeline pipeline, int idx, vector<Monitor*> dataMons, Monitor* resMon,
+	numa::AccessCounts* accesses) {
+	TRACE_THREAD_NAME("worker " + to_string(idx));
+	int nodeCount = dataMons.size();
+	int node = idx % nodeCount;
+	if (nodeCount > 1) { numa::pinWorker(idx, nodeCount); }
+
+	Car batch[BATCH_SIZE];
+	int n;
+	// The local monitor blocks until the producer is done with it, after
+	// that whatever is left on the other nodes is taken remotely
+	TRACE_ALLOCS_BEGIN(allocs, "worker steady-state allocations", ALLOC_CHECK_WARMUP);
+	while ((n = dataMons[node]->removeItems(batch, BATCH_SIZE)) > 0) {
+		accesses->local += n;
+		processBatch(pipeline, batch, n, resMon);
+		TRACE_ALLOCS_RECORDS(allocs, n);
+	}
+	for (int k = 1; k < nodeCount; k++) {
+		Monitor* dataMon = dataMons[(node + k) % nodeCount];
+		while ((n = dataMon->removeItems(batch, BATCH_SIZE)) > 0) {
+			accesses->remote += n;
+			processBatch(pipeline, batch, n, resMon);
+			TRACE_ALLOCS_RECORDS(allocs, n);
+		}
+	}
+	TRACE_ALLOCS_END(allocs);
+}
 
-		if (car == Car()) { break; }
+template <class Pipeline>
+void processBatch(const Pipeline& pipeline, Car* batch, int n, Monitor* resMon) {
+	for (int i = 0; i < n; i++) {
+		Car& car = batch[i];
 
-		SHA1 sha;
-		sha.update(car.name + to_string(car.year) + to_string(car.mileage));
-		car.hash = sha.final();
+		TRACE_SPAN(hash, "task SHA-1");
+		bool keep = pipeline.process(car);
+		TRACE_SPAN_END(hash);
 
-		if (FILTER_FROM_YEAR <= car.year) {
-			resMon->addItemSorted(car);
+		if (keep) {
+			resMon->addItemSorted(move(car), pipeline);
 		}
 	}
 }
 
-void writeInitialData(vector<Car> cars) {
+void writeInitialHeader(ostream& output) {
 	const int NameWidth = 25;
 	const int YearWidth = 5;
 	const int MileageWidth = 10;
@@ -197,8 +400,6 @@ void writeInitialData(vector<Car> cars) {
 	const int HLength = NameWidth + YearWidth + MileageWidth + HashWidth + 11;
 	const char* VerticalSeparator = " | ";
 
-	ofstream output(OUTPUT_FILE);
-
 	output << left << "Initial data" << endl;
 	output << string(HLength, HorizontalSeparator) << endl;
 	output << right << setw(NameWidth) << "Name" << VerticalSeparator
@@ -206,20 +407,39 @@ void writeInitialData(vector<Car> cars) {
 		<< setw(MileageWidth) << "Mileage" << VerticalSeparator
 		<< setw(HashWidth) << "Hash" << VerticalSeparator << endl;
 	output << string(HLength, HorizontalSeparator) << endl;
-	for (int i = 0; i < cars.size(); i++)
+}
+
+void writeInitialRows(ostream& output, const Car* cars, int n) {
+	TRACE_SCOPE("writeInitialData");
+	const int NameWidth = 25;
+	const int YearWidth = 5;
+	const int MileageWidth = 10;
+	const int HashWidth = 4;
+	const char* VerticalSeparator = " | ";
+
+	for (int i = 0; i < n; i++)
 	{
-		Car car = cars[i];
+		const Car& car = cars[i];
 		output << right << setw(NameWidth) << car.name << VerticalSeparator << setw(YearWidth)
 			<< car.year << VerticalSeparator << fixed << setprecision(2) << setw(MileageWidth)
 			<< car.mileage << VerticalSeparator << setw(HashWidth) << car.hash
 			<< VerticalSeparator << endl;
 	}
-	output << string(HLength, HorizontalSeparator) << endl;
+}
+
+void writeInitialFooter(ostream& output) {
+	const int NameWidth = 25;
+	const int YearWidth = 5;
+	const int MileageWidth = 10;
+	const int HashWidth = 4;
+	const char HorizontalSeparator = '-';
+	const int HLength = NameWidth + YearWidth + MileageWidth + HashWidth + 11;
 
-	output.close();
+	output << string(HLength, HorizontalSeparator) << endl;
 }
 
-void writeRes(Monitor* resMon) {
+void writeRes(async_io::AsyncWriter& writer, Monitor* resMon) {
+	TRACE_SCOPE("writeRes");
 	const int NameWidth = 25;
 	const int YearWidth = 5;
 	const int MileageWidth = 10;
@@ -228,7 +448,7 @@ void writeRes(Monitor* resMon) {
 	const int HLength = NameWidth + YearWidth + MileageWidth + HashWidth + 11;
 	const char* VerticalSeparator = " | ";
 
-	ofstream output(OUTPUT_FILE, ios_base::app);
+	ostream& output = writer.stream();
 
 	output << left << "Results" << endl;
 	output << string(HLength, HorizontalSeparator) << endl;
@@ -244,8 +464,7 @@ void writeRes(Monitor* resMon) {
 			<< car.year << VerticalSeparator << fixed << setprecision(2) << setw(MileageWidth)
 			<< car.mileage << VerticalSeparator << setw(HashWidth) << car.hash
 			<< VerticalSeparator << endl;
+		writer.flushIfFull();
 	}
 	output << string(HLength, HorizontalSeparator) << endl;
-
-	output.close();
 }
@@ -1,102 +1,169 @@
 #include <algorithm>
+#include <iostream>
+#include <thread>
 #include <omp.h>
 // Additional libraries used:
 // https://github.com/nlohmann/json
 #include <nlohmann/json.hpp>
-// https://github.com/vog/sha1
-#include "sha1-master/sha1.hpp"
+#include "../Common/numa.hpp"
+#include "../Common/pipeline.hpp"
+#include "../Common/reduction.hpp"
+#include "../Common/trace.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
 const string INPUT_FILE = "input.json";
 const string OUTPUT_FILE = "output.txt";
+const string TRACE_FILE = "trace.json";
+const string TRACE_SUMMARY_FILE = "trace_summary.txt";
 
 const int THREAD_NUM = 4;
 const int FILTER_FROM_YEAR = 2000; // Data range [1964;2021]
+// Pin threads across NUMA nodes, so the partition each thread builds is
+// first-touched on its node, and report where the records ended up.
+// Has no effect on single-node hosts.
+const bool NUMA_AWARE = false;
 
 struct Car {
     string name;
     int year;
     double mileage;
-    string hash;
+    char hash[digest::SHA1_HEX_LENGTH + 1];
 
-    Car(string _name = "", int _year = 0, double _mileage = 0.0, string _hash = "") {
+    Car(string _name = "", int _year = 0, double _mileage = 0.0, const char* _hash = "") {
         name = _name;
         year = _year;
         mileage = _mileage;
-        hash = _hash;
+        strncpy(hash, _hash, sizeof(hash));
+        hash[sizeof(hash) - 1] = 0;
     }
 
     bool operator== (const Car& _car) {
         return (!name.compare(_car.name) && year == _car.year
-                && mileage == _car.mileage && !hash.compare(_car.hash));
+                && mileage == _car.mileage && !strcmp(hash, _car.hash));
     }
 };
 
-vector<Car> readData();
+json readData();
 void splitElements(int arr[], int dataSize);
-void task(Car& car);
-void insertSorted(vector<Car> &cars, Car car);
-void writeInitialData(vector<Car> cars);
-void writeRes(vector<Car> cars, int sumYear, double sumMileage);
-
-int main() {
-    vector<Car> cars = readData();
+template <class Pipeline>
+void processCars(const Pipeline& pipeline, const json& carsData, bool numaAware,
+        vector<Car>& resCars, reduction::Totals& totals, numa::AccessCounts& accesses);
+template <class Pipeline>
+void insertSorted(const Pipeline& pipeline, vector<Car> &cars, Car car);
+void writeInitialData(const json& carsData);
+void writeRes(vector<Car> cars, long long sumYear, double sumMileage);
+
+int main(int argc, char* argv[]) {
+    int filterFromYear = (argc > 1) ? atoi(argv[1]) : FILTER_FROM_YEAR;
+    json carsData = readData();
     vector<Car> resCars;
-    resCars.reserve(cars.size());
-    int sumYear = 0;
-    double sumMileage = 0;
+    resCars.reserve(carsData.size());
+    reduction::Totals totals;
+    numa::AccessCounts accesses;
+    bool numaAware = NUMA_AWARE && numa::nodeCount() > 1;
+
+    // The initial data only needs the input fields, so it is written from the
+    // parsed input while the threads build and hash their cars
+    thread initialWriter(writeInitialData, cref(carsData));
+
+    pipeline::dispatchYearFilter<FILTER_FROM_YEAR>(filterFromYear, [&](auto pipeline) {
+        processCars(pipeline, carsData, numaAware, resCars, totals, accesses);
+    });
+
+    if (numaAware) {
+        cout << "NUMA nodes: " << numa::nodeCount() << ", local record accesses: " << accesses.local
+            << ", remote: " << accesses.remote << endl;
+    }
+
+    initialWriter.join();
+    writeRes(resCars, totals.year, totals.mileageSum());
+
+    TRACE_WRITE(TRACE_FILE, TRACE_SUMMARY_FILE);
+
+    return 0;
+}
+
+template <class Pipeline>
+void processCars(const Pipeline& pipeline, const json& carsData, bool numaAware,
+        vector<Car>& resCars, reduction::Totals& totals, numa::AccessCounts& accesses) {
+    vector<reduction::Totals> partials(THREAD_NUM);
+    long long localAccesses = 0;
+    long long remoteAccesses = 0;
 
     int endParts[THREAD_NUM];
-    splitElements(endParts, cars.size());
+    splitElements(endParts, carsData.size());
 
     omp_set_num_threads(THREAD_NUM);
-#pragma omp parallel shared(cars, resCars) default(none) firstprivate(endParts) reduction(+:sumYear, sumMileage)
+#pragma omp parallel shared(carsData, numaAware, resCars, pipeline, partials) default(none) \
+        firstprivate(endParts) reduction(+:localAccesses, remoteAccesses)
     {
         int idx = omp_get_thread_num();
         int start = (idx == 0) ? 0 : endParts[idx - 1];
-        int end = (idx == THREAD_NUM - 1) ? cars.size() : endParts[idx];
+        int end = (idx == THREAD_NUM - 1) ? carsData.size() : endParts[idx];
+        TRACE_THREAD_NAME("omp " + to_string(idx));
 
+        if (numaAware) {
+            numa::pinWorker(idx, numa::nodeCount());
+        }
+
+        // Built by the thread that hashes it, so after pinning the partition
+        // is first-touched on that thread's node
+        vector<Car> part;
+        part.reserve(end - start);
         for (int i = start; i < end; i++) {
-            task(cars[i]);
-            if (FILTER_FROM_YEAR > cars[i].year) {
+            part.push_back({
+                carsData[i]["name"],
+                carsData[i]["year"],
+                carsData[i]["mileage"],
+            });
+        }
+        int partSize = part.size();
+
+        if (numaAware) {
+            // Checks that first touch placed the pages; the kernel may fall
+            // back to another node when the local one is short on memory
+            numa::AccessCounts partAccesses;
+            numa::countAccesses(part.data(), partSize, numa::currentNode(), partAccesses);
+            localAccesses += partAccesses.local;
+            remoteAccesses += partAccesses.remote;
+        }
+
+        vector<unsigned char> keep(partSize);
+        for (int i = 0; i < partSize; i++) {
+            {
+                TRACE_SCOPE("task SHA-1");
+                keep[i] = pipeline.process(part[i]);
+            }
+            if (!keep[i]) {
                 continue;
             }
+            TRACE_SPAN(wait, "omp critical wait");
 #pragma omp critical
             {
-                insertSorted(resCars, cars[i]);
-                sumYear += cars[i].year;
-                sumMileage += cars[i].mileage;
+                TRACE_SPAN_END(wait);
+                TRACE_SCOPE("insertSorted");
+                insertSorted(pipeline, resCars, part[i]);
             }
         }
-    }
 
-    writeInitialData(cars);
-    writeRes(resCars, sumYear, sumMileage);
+        // Each thread sums its own partition outside the critical section
+        partials[idx] = reduction::accumulate(part.data(), keep.data(), partSize);
+    }
 
-    return 0;
+    totals = reduction::combineTree(partials);
+    accesses.local = localAccesses;
+    accesses.remote = remoteAccesses;
 }
 
-vector<Car> readData() {
-    vector<Car> cars;
-
+// Only parses the input; the cars are built by the threads that process them.
+json readData() {
+    TRACE_SCOPE("readData");
     ifstream f(INPUT_FILE);
     json fileData = json::parse(f);
 
-    json carsData = fileData["cars"];
-    for (int i = 0; i < carsData.size(); i++) {
-
-        Car newCar = {
-            carsData[i]["name"],
-            carsData[i]["year"],
-            carsData[i]["mileage"],
-        };
-
-        cars.push_back(newCar);
-    }
-
-    return cars;
+    return move(fileData["cars"]);
 }
 
 void splitElements(int arr[], int dataSize) {
@@ -114,18 +181,13 @@ void splitElements(int arr[], int dataSize) {
     }
 }
 
-void task(Car& car) {
-    SHA1 sha;
-    sha.update(car.name + to_string(car.year) + to_string(car.mileage));
-    car.hash = sha.final();
-}
-
-void insertSorted(vector<Car> &cars, Car car)
+template <class Pipeline>
+void insertSorted(const Pipeline& pipeline, vector<Car> &cars, Car car)
 {
     vector<Car>::iterator it;
 
     for (it = cars.begin(); it < cars.end(); it++) {
-        if (it->hash.compare(car.hash) > 0) {
+        if (pipeline.before(car, *it)) {
             cars.insert(it, car);
             return;
         }
@@ -134,7 +196,8 @@ void insertSorted(vector<Car> &cars, Car car)
     cars.push_back(car);
 }
 
-void writeInitialData(vector<Car> cars) {
+void writeInitialData(const json& carsData) {
+    TRACE_SCOPE("writeInitialData");
     const int NameWidth = 25;
     const int YearWidth = 5;
     const int MileageWidth = 10;
@@ -152,20 +215,21 @@ void writeInitialData(vector<Car> cars) {
         << setw(MileageWidth) << "Mileage" << VerticalSeparator
         << setw(HashWidth) << "Hash" << VerticalSeparator << endl;
     output << string(HLength, HorizontalSeparator) << endl;
-    for (int i = 0; i < cars.size(); i++)
+    for (int i = 0; i < carsData.size(); i++)
     {
-        Car car = cars[i];
-        output << right << setw(NameWidth) << car.name << VerticalSeparator << setw(YearWidth)
-            << car.year << VerticalSeparator << fixed << setprecision(2) << setw(MileageWidth)
-            << car.mileage << VerticalSeparator << setw(HashWidth) << ""
-            << VerticalSeparator << endl;
+        const json& car = carsData[i];
+        output << right << setw(NameWidth) << car["name"].get<string>() << VerticalSeparator
+            << setw(YearWidth) << car["year"].get<int>() << VerticalSeparator << fixed
+            << setprecision(2) << setw(MileageWidth) << car["mileage"].get<double>()
+            << VerticalSeparator << setw(HashWidth) << "" << VerticalSeparator << endl;
     }
     output << string(HLength, HorizontalSeparator) << endl;
 
     output.close();
 }
 
-void writeRes(vector<Car> cars, int sumYear, double sumMileage) {
+void writeRes(vector<Car> cars, long long sumYear, double sumMileage) {
+    TRACE_SCOPE("writeRes");
     const int NameWidth = 25;
     const int YearWidth = 5;
     const int MileageWidth = 10;